@@ -11,7 +11,9 @@
  *************************************/
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "driverlib/can.h"
+#include "driverlib/interrupt.h"
 #include "LeiA.h"
 
 /*************************************
@@ -30,6 +32,26 @@ tCANMsgObject msg_received; //CAN msg that will be recieved
 
 volatile uint64_t mac_calculated_till_mac;
 
+/* MAC TX scheduling */
+volatile uint32_t tick_count       = 0; //ticks of LeiA_MainFunction
+volatile uint32_t tick_frames      = 0; //frames seen on the bus in the current tick
+volatile uint32_t idle_ticks       = 0; //ticks in a row without frames on the bus
+volatile uint32_t window_ticks     = 0; //ticks elapsed in the bus load window
+volatile uint32_t window_bits      = 0; //bits seen on the bus in the bus load window
+volatile uint8_t  mac_tx_open      = 0; //own MAC frame sent in the current tick
+volatile uint32_t mac_tx_bits      = 0; //length of the last own MAC frame in bits
+volatile uint16_t mac_tx_id        = 0; //11-bit id of the last own MAC frame
+
+tCANMsgObject     mac_pending;          //deferred MAC msg
+uint64_t          mac_pending_data;     //payload of the deferred MAC msg
+volatile uint8_t  mac_pending_valid = 0;
+volatile uint32_t mac_pending_tick  = 0; //tick the MAC was deferred at
+
+mac_tx_stats_t mac_tx_stats;
+
+pending_t pending[LEIA_PENDING_SIZE]; //data/MAC frames waiting for their partner
+rx_sender_t rx_senders[LEIA_RX_SENDERS]; //authenticated senders this node receives from
+
 
 /*************************************
  *      Functions Section
@@ -67,11 +89,17 @@ void LeiA_Init(void){
     t.id_msg    = 0x100; /* msg ID */
     t.id_mac    = 0x101; /* id of MAC */
     t.id_fail   = 0x102; /* id of AUTH Fail */
+    t.id_mac_low      = 0x701; /* low priority id of MAC */
+    t.mac_tx_policy   = LEIA_MAC_TX_IMMEDIATE; /* MAC TX scheduling policy */
+    t.mac_max_latency = 5; /* max MAC deferral in ticks */
+    t.rx_pair_timeout = 10; /* max wait for data/MAC partner in ticks */
     t.kid       = 10; /* 128 bit key */
     t.eid       = 0; /* 56 Epoch Counter*/
     t.keid      = 0; /* 128 Temp key*/
     t.cid       = 0; /* 16 counter*/
     t.data      = 0x55; /* 64 data */
+
+    LeiA_SetRxSender(0, 0x200, 0x201, 0x701); /* remote data/MAC/low priority MAC ids */
 }
 
 
@@ -122,10 +150,26 @@ uint64_t CalculateEidMac(void)
 *             Remarks: -
 ***************************************************************************************************/
 uint64_t  CalculateMacData(void)
+{
+    return CalculateMacReceived(t.cid, t.data);
+}
+
+/***************************************************************************************************
+*       Function name: CalculateMacReceived
+*         Description: calculate the MAC of a received data msg
+*     Parameters (IN): uint16_t cid counter of the received msg
+*                      uint64_t data of the received msg
+*    Parameters (OUT): -
+* Parameters (IN/OUT): -
+*        Return value: uint64_t mac data
+*    Global variables: -
+*             Remarks: also used by CalculateMacData with this node counter and data
+***************************************************************************************************/
+uint64_t CalculateMacReceived(uint16_t cid, uint64_t data)
 {
     uint64_t temp_mac;
     //MAC data is sum of temp key + counter + data
-    temp_mac = t.keid + t.cid + t.data;
+    temp_mac = t.keid + cid + data;
     return temp_mac;
 }
 
@@ -170,8 +214,17 @@ uint8_t ValidateEC(void)
 ***************************************************************************************************/
 void UpdateEC(void)
 {
+  uint32_t i;
+
   t.eid = m_rx.eid_received;
   t.cid = m_rx.cid;
+
+  // the epoch changed, restart the accepted counters of the senders from the new one
+  for (i = 0; i < LEIA_RX_SENDERS; i++)
+  {
+    rx_senders[i].cid      = m_rx.cid;
+    rx_senders[i].cid_mask = 0;
+  }
 }
 
 
@@ -268,6 +321,353 @@ uint8_t sendToBus(tCANMsgObject msg){
 
 }
 
+/***************************************************************************************************
+*       Function name: EnterCritical
+*         Description: mask the interrupts while shared state is accessed
+*     Parameters (IN): -
+*    Parameters (OUT): -
+* Parameters (IN/OUT): -
+*        Return value: uint8_t 1 if the interrupts were already masked
+*    Global variables: -
+*             Remarks: pass the return value to ExitCritical so nested sections work
+***************************************************************************************************/
+uint8_t EnterCritical(void)
+{
+    if(IntMasterDisable()){
+        return 1;
+    }else{
+        return 0;
+    }
+}
+
+/***************************************************************************************************
+*       Function name: ExitCritical
+*         Description: unmask the interrupts again after EnterCritical
+*     Parameters (IN): uint8_t wasMasked return value of EnterCritical
+*    Parameters (OUT): -
+* Parameters (IN/OUT): -
+*        Return value: -
+*    Global variables: -
+*             Remarks: -
+***************************************************************************************************/
+void ExitCritical(uint8_t wasMasked)
+{
+    if(wasMasked == 0){
+        IntMasterEnable();
+    }
+}
+
+/***************************************************************************************************
+*       Function name: BaseId
+*         Description: get the 11-bit id used for arbitration from a can msg id
+*     Parameters (IN): uint32_t id
+*    Parameters (OUT): -
+* Parameters (IN/OUT): -
+*        Return value: uint16_t 11-bit id
+*    Global variables: -
+*             Remarks: -
+***************************************************************************************************/
+uint16_t BaseId(uint32_t id)
+{
+    if(0 != (id & 0x80000000)){
+        return (id >> 18) & 0x7ff; // msg id is encoded above the command code and counter
+    }else{
+        return id & 0x7ff;
+    }
+}
+
+/***************************************************************************************************
+*       Function name: FrameBits
+*         Description: estimate the length of a can frame on the bus in bits
+*     Parameters (IN): tCANMsgObject msg
+*    Parameters (OUT): -
+* Parameters (IN/OUT): -
+*        Return value: uint32_t number of bits
+*    Global variables: -
+*             Remarks: bit stuffing is not included
+***************************************************************************************************/
+uint32_t FrameBits(tCANMsgObject msg)
+{
+    if(0 != (msg.ui32MsgID & 0x80000000)){
+        return 67 + (8 * msg.ui32MsgLen); // extended frame overhead + data
+    }else{
+        return 47 + (8 * msg.ui32MsgLen); // standard frame overhead + data
+    }
+}
+
+/***************************************************************************************************
+*       Function name: ObserveFrame
+*         Description: account a frame seen on the bus for the bus load measurement
+*     Parameters (IN): tCANMsgObject msg
+*                      uint8_t isOwn 1 if the frame was sent by this node
+*    Parameters (OUT): -
+* Parameters (IN/OUT): -
+*        Return value: -
+*    Global variables: window_bits, tick_frames, mac_tx_stats
+*             Remarks: a received lower priority frame after an own MAC frame in the same tick is
+*                      counted as losing arbitration to it and delayed by the MAC frame length.
+*                      this is an upper bound, the frame may have been queued after the MAC
+*                      already left the bus. only frames passing the acceptance filter are seen,
+*                      so the bus load is underestimated
+***************************************************************************************************/
+void ObserveFrame(tCANMsgObject msg, uint8_t isOwn)
+{
+    uint8_t wasMasked;
+
+    wasMasked = EnterCritical();
+    window_bits += FrameBits(msg);
+    tick_frames++;
+
+    if((isOwn == 0) && (mac_tx_open != 0) && (BaseId(msg.ui32MsgID) > mac_tx_id)){
+        mac_tx_stats.frames_delayed++;
+        mac_tx_stats.frames_delay_bits += mac_tx_bits;
+    }
+    ExitCritical(wasMasked);
+}
+
+/***************************************************************************************************
+*       Function name: SendMac
+*         Description: send a MAC msg to the bus and keep track of it for the stats
+*     Parameters (IN): tCANMsgObject msg
+*    Parameters (OUT): -
+* Parameters (IN/OUT): -
+*        Return value: 1 or 0 indicating send state
+*    Global variables: mac_tx_open, mac_tx_bits, mac_tx_id
+*             Remarks: -
+***************************************************************************************************/
+uint8_t SendMac(tCANMsgObject msg)
+{
+    uint8_t wasMasked;
+
+    if(1==sendToBus(msg)){
+        ObserveFrame(msg, 1);
+        wasMasked = EnterCritical();
+        mac_tx_open = 1;
+        mac_tx_bits = FrameBits(msg);
+        mac_tx_id   = BaseId(msg.ui32MsgID);
+        ExitCritical(wasMasked);
+        return 1;
+    }else{
+        return 0;
+    }
+}
+
+/***************************************************************************************************
+*       Function name: SendPendingMac
+*         Description: send the deferred MAC msg and update the deferral latency stats
+*     Parameters (IN): mac_tx_reason_t reason why the deferred MAC leaves now
+*    Parameters (OUT): -
+* Parameters (IN/OUT): -
+*        Return value: -
+*    Global variables: mac_pending, mac_pending_valid, mac_tx_stats
+*             Remarks: the MAC is taken out of mac_pending with the interrupts masked and sent
+*                      after they are unmasked again
+***************************************************************************************************/
+void SendPendingMac(mac_tx_reason_t reason)
+{
+    tCANMsgObject msg;
+    uint64_t canData;
+    uint32_t latency;
+    uint8_t wasMasked;
+
+    wasMasked = EnterCritical();
+    if(mac_pending_valid == 0){
+        ExitCritical(wasMasked);
+        return;
+    }
+    msg     = mac_pending;
+    canData = mac_pending_data;
+    mac_pending_valid = 0;
+    latency = tick_count - mac_pending_tick;
+
+    mac_tx_stats.defer_latency_total += latency;
+    if(latency > mac_tx_stats.defer_latency_max){
+        mac_tx_stats.defer_latency_max = latency;
+    }
+    switch(reason)
+    {
+      case LEIA_MAC_SENT_IDLE:
+        mac_tx_stats.mac_deferred++;
+      break;
+
+      case LEIA_MAC_SENT_LATENCY:
+        mac_tx_stats.mac_forced++;
+      break;
+
+      default:
+        mac_tx_stats.mac_flushed++;
+      break;
+    }
+    ExitCritical(wasMasked);
+
+    msg.pui8MsgData = (uint8_t *)&canData;
+    if(1==SendMac(msg)){
+        //done
+    }else{
+        // the mac msg wasn't sent
+    }
+}
+
+/***************************************************************************************************
+*       Function name: ScheduleMac
+*         Description: send or defer the MAC msg according to the session MAC TX policy
+*     Parameters (IN): uint32_t temp_id encoded extended id without the msg id
+*                      uint64_t mac
+*    Parameters (OUT): -
+* Parameters (IN/OUT): -
+*        Return value: -
+*    Global variables: t, mac_pending, mac_tx_stats
+*             Remarks: the policy only applies while the bus load is above LEIA_BUSLOAD_HIGH_PCT,
+*                      otherwise the MAC is sent immediately. a deferred MAC is sent by
+*                      LeiA_MainFunction, the previous one is flushed by SendDataMac
+***************************************************************************************************/
+void ScheduleMac(uint32_t temp_id, uint64_t mac)
+{
+    tCANMsgObject msg;
+    uint64_t canData;
+    uint16_t id = t.id_mac;
+    uint8_t isBusy = (mac_tx_stats.bus_load >= LEIA_BUSLOAD_HIGH_PCT);
+    uint8_t wasMasked;
+
+    switch(t.mac_tx_policy)
+    {
+      case LEIA_MAC_TX_DEFER_IDLE:
+        if((isBusy != 0) && (t.mac_max_latency != 0))
+        {
+            wasMasked = EnterCritical();
+            mac_pending.ui32MsgID   = mkExtId(temp_id + (t.id_mac<<18));
+            mac_pending.ui32MsgLen  = 8;
+            mac_pending_data        = mac;
+            mac_pending.pui8MsgData = (uint8_t *)&mac_pending_data;
+            mac_pending_tick        = tick_count;
+            mac_pending_valid       = 1;
+            ExitCritical(wasMasked);
+            return;
+        }
+      break;
+
+      case LEIA_MAC_TX_REMAP_ID:
+        if(isBusy != 0)
+        {
+            id = t.id_mac_low;
+        }
+      break;
+
+      default:
+      break;
+    }
+
+    msg.ui32MsgID   = mkExtId(temp_id + (id<<18));
+    msg.ui32MsgLen  = 8;
+    canData         = mac;
+    msg.pui8MsgData = (uint8_t *)&canData;
+    if(id != t.id_mac){
+        mac_tx_stats.mac_remapped++;
+    }else{
+        mac_tx_stats.mac_immediate++;
+    }
+    if(1==SendMac(msg)){
+        //done
+    }else{
+        // the mac msg wasn't sent
+    }
+}
+
+/***************************************************************************************************
+*       Function name: LeiA_SetMacTxPolicy
+*         Description: configure how the MAC frames of this session are scheduled
+*     Parameters (IN): mac_tx_policy_t policy
+*                      uint16_t id_mac_low 11-bit id used by LEIA_MAC_TX_REMAP_ID
+*                      uint16_t max_latency max deferral in ticks used by LEIA_MAC_TX_DEFER_IDLE
+*    Parameters (OUT): -
+* Parameters (IN/OUT): -
+*        Return value: -
+*    Global variables: t
+*             Remarks: LEIA_MAC_TX_DEFER_IDLE needs LeiA_MainFunction to be called periodically.
+*                      max_latency must stay below the rx_pair_timeout of the receivers (see
+*                      LeiA_SetPairTimeout), otherwise deferred MACs arrive after the receiver
+*                      dropped their data msg
+***************************************************************************************************/
+void LeiA_SetMacTxPolicy(mac_tx_policy_t policy, uint16_t id_mac_low, uint16_t max_latency)
+{
+    t.mac_tx_policy   = policy;
+    t.id_mac_low      = id_mac_low & 0x7ff;
+    t.mac_max_latency = max_latency;
+}
+
+/***************************************************************************************************
+*       Function name: LeiA_GetMacTxStats
+*         Description: copy the MAC TX scheduling stats
+*     Parameters (IN): -
+*    Parameters (OUT): mac_tx_stats_t *stats
+* Parameters (IN/OUT): -
+*        Return value: -
+*    Global variables: mac_tx_stats
+*             Remarks: -
+***************************************************************************************************/
+void LeiA_GetMacTxStats(mac_tx_stats_t *stats)
+{
+    *stats = mac_tx_stats;
+}
+
+/***************************************************************************************************
+*       Function name: LeiA_MainFunction
+*         Description: periodic task measuring the bus load and sending deferred MACs
+*     Parameters (IN): -
+*    Parameters (OUT): -
+* Parameters (IN/OUT): -
+*        Return value: -
+*    Global variables: tick_count, window_bits, mac_pending, mac_tx_stats, pending
+*             Remarks: should be called every LEIA_TICK_MS ms (e.g. from the SysTick handler),
+*                      on the sender for deferred MACs and on the receiver to expire unmatched
+*                      data/MAC frames. the idle window is a coarse heuristic: a whole tick
+*                      without an observed frame is rare on a busy bus, so most deferred MACs
+*                      are expected to leave on the latency bound (see mac_forced)
+***************************************************************************************************/
+void LeiA_MainFunction(void)
+{
+    uint32_t capacity;
+    uint32_t load;
+    uint8_t wasMasked;
+    uint8_t isIdle    = 0;
+    uint8_t isExpired = 0;
+
+    wasMasked = EnterCritical();
+    // close the tick that just ended
+    if(tick_frames == 0){
+        idle_ticks++;
+    }else{
+        idle_ticks = 0;
+    }
+    tick_frames = 0;
+    mac_tx_open = 0;
+    tick_count++;
+
+    window_ticks++;
+    if(window_ticks >= LEIA_BUSLOAD_WINDOW_TICKS){
+        // bits the bus can carry in one window
+        capacity = (LEIA_BUS_BITRATE / 1000) * LEIA_TICK_MS * LEIA_BUSLOAD_WINDOW_TICKS;
+        load = (window_bits * 100) / capacity;
+        mac_tx_stats.bus_load = (load > 100) ? 100 : load;
+        window_bits  = 0;
+        window_ticks = 0;
+    }
+
+    if(mac_pending_valid != 0){
+        isIdle    = (idle_ticks >= LEIA_BUS_IDLE_TICKS);
+        isExpired = ((tick_count - mac_pending_tick) >= t.mac_max_latency);
+    }
+    ExitCritical(wasMasked);
+
+    ExpirePending();
+
+    if(isIdle != 0){
+        SendPendingMac(LEIA_MAC_SENT_IDLE); // bus idle window
+    }else if(isExpired != 0){
+        SendPendingMac(LEIA_MAC_SENT_LATENCY); // latency bound expired
+    }
+}
+
 
 /*****************************************************************************/
 /* !Description: Session Key Generation                                      */
@@ -332,6 +732,8 @@ void SendDataMac(void)
     uint64_t canData ;
     uint8_t *pointerCanToData = (uint8_t *)&canData;
 
+    // only one MAC can wait at a time, send the older one before the next data msg
+    SendPendingMac(LEIA_MAC_SENT_FLUSH);
 
     temp_id  = EncodeExtendedId(0); // the important bits are 18 bits ,command code ==0 means data msg
     temp_id += t.id_msg<<18;
@@ -343,22 +745,14 @@ void SendDataMac(void)
     msg.pui8MsgData = (uint8_t *)&canData;
 //    output(msg);
     if(1==sendToBus(msg)){ //send data msg to channel
+        ObserveFrame(msg, 1);
         //preparing the msc msg
 
         temp_id  = EncodeExtendedId(1);//command code ==0 means mac msg
-        temp_id += t.id_mac<<18;
-        msg.ui32MsgID= mkExtId(temp_id);
 
         //if (debug_state == ENABLE) write("Sender: Calculate MAC Data");
-        msg.ui32MsgLen = 8;
-        canData = CalculateMacData();
-        msg.pui8MsgData =(uint8_t *)&canData;
-        if(1==sendToBus(msg)){
-            //done
-
-        }else{
-            // the mac msg wasn't sent
-        }
+        // the id of the MAC msg depends on the MAC TX policy
+        ScheduleMac(temp_id, CalculateMacData());
     }else{
         // the data msg wasn't sent
     }
@@ -479,26 +873,288 @@ void LeiA_HandleEidiMacReceived(void)
 *    Parameters (OUT): -
 * Parameters (IN/OUT): -
 *        Return value: -
-*    Global variables: -
-*             Remarks: -
+*    Global variables: m_rx, rx_senders, t
+*             Remarks: the MAC is computed with the received counter, so the counter has to be
+*                      checked for freshness to reject replayed data/MAC pairs
 ***************************************************************************************************/
 void LeiA_HandleDataMacReceived(void)
 {
-//  if (debug_state == ENABLE) write("Sender: Update Counters");
-  UpdateCounters();
+  rx_sender_t *sender;
+
+  sender = FindRxSender(m_rx.id);
 
-  if (m_rx.mac_computed != m_rx.mac_received)
+  if ((sender == 0) || (m_rx.mac_computed != m_rx.mac_received)
+      || (ValidateCid(sender, m_rx.cid) == 0))
   {
 //    if (debug_state == ENABLE) write("Sender: Send Auth Fail Message");
     LeiA_SendAuthFailMessage();
   }
   else
   {
+//  if (debug_state == ENABLE) write("Sender: Update Counters");
+    AcceptCid(sender, m_rx.cid);
+    t.cid = sender->cid;
     if (debug_state == ENABLE) write("News - Sender: Normal Message Received");
     /* Normal Message Received */
   }
 }
 
+/***************************************************************************************************
+*       Function name: LeiA_SetRxSender
+*         Description: configure the ids of an authenticated sender this node receives from
+*     Parameters (IN): uint8_t index in the sender table
+*                      uint16_t id_msg 11-bit id of the data msg
+*                      uint16_t id_mac 11-bit id of the MAC msg
+*                      uint16_t id_mac_low 11-bit low priority id of the MAC msg (remapped MAC)
+*    Parameters (OUT): -
+* Parameters (IN/OUT): -
+*        Return value: -
+*    Global variables: rx_senders
+*             Remarks: should be called before the CAN reception is enabled. the ids have to be
+*                      distinct across senders, id_mac_low has to match the one the sender passed
+*                      to LeiA_SetMacTxPolicy
+***************************************************************************************************/
+void LeiA_SetRxSender(uint8_t index, uint16_t id_msg, uint16_t id_mac, uint16_t id_mac_low)
+{
+    if(index < LEIA_RX_SENDERS){
+        rx_senders[index].is_used    = 1;
+        rx_senders[index].id_msg     = id_msg & 0x7ff;
+        rx_senders[index].id_mac     = id_mac & 0x7ff;
+        rx_senders[index].id_mac_low = id_mac_low & 0x7ff;
+        rx_senders[index].cid        = t.cid;
+        rx_senders[index].cid_mask   = 0;
+    }
+}
+
+/***************************************************************************************************
+*       Function name: FindRxSender
+*         Description: find the sender a received data or MAC msg id belongs to
+*     Parameters (IN): uint16_t id 11-bit id of the msg
+*    Parameters (OUT): -
+* Parameters (IN/OUT): -
+*        Return value: rx_sender_t * sender or 0 if the id is unknown
+*    Global variables: rx_senders
+*             Remarks: -
+***************************************************************************************************/
+rx_sender_t *FindRxSender(uint16_t id)
+{
+    uint32_t i;
+
+    for(i = 0; i < LEIA_RX_SENDERS; i++){
+        if((rx_senders[i].is_used != 0)
+           && ((rx_senders[i].id_msg == id) || (rx_senders[i].id_mac == id)
+               || (rx_senders[i].id_mac_low == id))){
+            return &rx_senders[i];
+        }
+    }
+    return 0;
+}
+
+/***************************************************************************************************
+*       Function name: ValidateCid
+*         Description: check that a received counter was not accepted before
+*     Parameters (IN): uint16_t cid received counter
+*    Parameters (OUT): -
+* Parameters (IN/OUT): rx_sender_t *sender
+*        Return value: uint8_t 1 or 0
+*    Global variables: -
+*             Remarks: a counter newer than the last accepted one is fresh. an older one is only
+*                      fresh inside the last LEIA_REPLAY_WINDOW counters and if not seen yet,
+*                      so pairs completing out of order still pass
+***************************************************************************************************/
+uint8_t ValidateCid(rx_sender_t *sender, uint16_t cid)
+{
+    uint16_t age;
+
+    if(cid > sender->cid){
+        return 1;
+    }
+
+    age = sender->cid - cid;
+    if((age == 0) || (age > LEIA_REPLAY_WINDOW)){
+        return 0;
+    }
+    if(0 != (sender->cid_mask & ((uint32_t)1 << (age - 1)))){
+        return 0; // already accepted
+    }
+    return 1;
+}
+
+/***************************************************************************************************
+*       Function name: AcceptCid
+*         Description: record a fresh counter as accepted
+*     Parameters (IN): uint16_t cid received counter
+*    Parameters (OUT): -
+* Parameters (IN/OUT): rx_sender_t *sender
+*        Return value: -
+*    Global variables: -
+*             Remarks: bit n of cid_mask marks counter (cid - n - 1) as accepted
+***************************************************************************************************/
+void AcceptCid(rx_sender_t *sender, uint16_t cid)
+{
+    uint16_t shift;
+
+    if(cid > sender->cid){
+        shift = cid - sender->cid;
+        if(shift > LEIA_REPLAY_WINDOW){
+            sender->cid_mask = 0;
+        }else{
+            // the previous newest counter moves into the mask
+            sender->cid_mask = (sender->cid_mask << 1) | 1;
+            sender->cid_mask <<= (shift - 1);
+        }
+        sender->cid = cid;
+    }else{
+        sender->cid_mask |= ((uint32_t)1 << (sender->cid - cid - 1));
+    }
+}
+
+/***************************************************************************************************
+*       Function name: LeiA_SetPairTimeout
+*         Description: configure how long a data/MAC frame waits for its partner
+*     Parameters (IN): uint16_t timeout in ticks
+*    Parameters (OUT): -
+* Parameters (IN/OUT): -
+*        Return value: -
+*    Global variables: t
+*             Remarks: entries only expire while LeiA_MainFunction is called periodically,
+*                      without it a full table drops its oldest entry instead. the timeout must
+*                      be greater than the mac_max_latency of the senders (see
+*                      LeiA_SetMacTxPolicy) plus the transmission time of the MAC msg
+***************************************************************************************************/
+void LeiA_SetPairTimeout(uint16_t timeout)
+{
+    t.rx_pair_timeout = timeout;
+}
+
+/***************************************************************************************************
+*       Function name: ReadCanData
+*         Description: copy the payload of a can msg into a 64bit value
+*     Parameters (IN): tCANMsgObject msg
+*    Parameters (OUT): -
+* Parameters (IN/OUT): -
+*        Return value: uint64_t payload
+*    Global variables: -
+*             Remarks: -
+***************************************************************************************************/
+uint64_t ReadCanData(tCANMsgObject msg)
+{
+    uint64_t canData = 0;
+    uint8_t *pointerCanToData = (uint8_t *)&canData;
+    uint32_t i;
+
+    for(i = 0; (i < msg.ui32MsgLen) && (i < 8); i++){
+        pointerCanToData[i] = msg.pui8MsgData[i];
+    }
+    return canData;
+}
+
+/***************************************************************************************************
+*       Function name: GetPending
+*         Description: find the pending entry of a data/MAC pair or allocate a new one
+*     Parameters (IN): uint16_t id 11-bit ID of the data msg
+*                      uint16_t cid
+*                      uint8_t isMac 1 if the entry is needed for a MAC msg
+*    Parameters (OUT): -
+* Parameters (IN/OUT): -
+*        Return value: pending_t * entry of the pair or 0 if no entry can be allocated
+*    Global variables: pending
+*             Remarks: if the table is full the oldest MAC only entry is dropped. a MAC msg never
+*                      drops an entry holding a data msg, so stray MACs can't push out real data.
+*                      must be called with the interrupts masked
+***************************************************************************************************/
+pending_t *GetPending(uint16_t id, uint16_t cid, uint8_t isMac)
+{
+    pending_t *entry = 0;
+    pending_t *oldest = 0;
+    uint32_t i;
+
+    for(i = 0; i < LEIA_PENDING_SIZE; i++){
+        if((pending[i].is_used != 0) && (pending[i].id == id) && (pending[i].cid == cid)){
+            return &pending[i];
+        }
+    }
+
+    for(i = 0; i < LEIA_PENDING_SIZE; i++){
+        if(pending[i].is_used == 0){
+            entry = &pending[i];
+            break;
+        }
+        if((oldest == 0) || ((tick_count - pending[i].tick) > (tick_count - oldest->tick))){
+            oldest = &pending[i]; // oldest so far
+        }
+        if((pending[i].has_data == 0)
+           && ((entry == 0) || ((tick_count - pending[i].tick) > (tick_count - entry->tick)))){
+            entry = &pending[i]; // oldest MAC only entry so far
+        }
+    }
+
+    if((entry == 0) && (isMac == 0)){
+        entry = oldest;
+    }
+    if(entry == 0){
+        return 0;
+    }
+
+    entry->is_used  = 1;
+    entry->has_data = 0;
+    entry->has_mac  = 0;
+    entry->id       = id;
+    entry->cid      = cid;
+    entry->tick     = tick_count;
+    return entry;
+}
+
+/***************************************************************************************************
+*       Function name: ExpirePending
+*         Description: drop the pending entries that waited longer than rx_pair_timeout
+*     Parameters (IN): -
+*    Parameters (OUT): -
+* Parameters (IN/OUT): -
+*        Return value: -
+*    Global variables: pending
+*             Remarks: -
+***************************************************************************************************/
+void ExpirePending(void)
+{
+    uint32_t i;
+    uint8_t wasMasked;
+
+    wasMasked = EnterCritical();
+    for(i = 0; i < LEIA_PENDING_SIZE; i++){
+        if((pending[i].is_used != 0) && ((tick_count - pending[i].tick) >= t.rx_pair_timeout)){
+            pending[i].is_used = 0;
+        }
+    }
+    ExitCritical(wasMasked);
+}
+
+/***************************************************************************************************
+*       Function name: CompletePending
+*         Description: release a pending entry into m_rx once both its data and MAC msgs arrived
+*     Parameters (IN): -
+*    Parameters (OUT): -
+* Parameters (IN/OUT): pending_t *entry
+*        Return value: uint8_t 1 if the pair is complete and ready to be verified
+*    Global variables: m_rx
+*             Remarks: the MAC was already computed when the data msg arrived.
+*                      must be called with the interrupts masked
+***************************************************************************************************/
+uint8_t CompletePending(pending_t *entry)
+{
+    if((entry->has_data != 0) && (entry->has_mac != 0))
+    {
+        m_rx.id           = entry->id;
+        m_rx.cid          = entry->cid;
+        m_rx.data         = entry->data;
+        m_rx.mac_computed = entry->mac_computed;
+        m_rx.mac_received = entry->mac_received;
+        entry->is_used = 0;
+        return 1;
+    }
+    return 0;
+}
+
 /*****************************************************************************/
 /* !Description: Handle Resynchronization at Receiver Side                   */
 /*****************************************************************************/
@@ -545,6 +1201,10 @@ uint8_t isExtId(uint32_t id)
 void DecodeReceivedMessage(void)
 {
   int temp_received_id;
+  pending_t *entry;
+  rx_sender_t *sender;
+  uint8_t wasMasked;
+  uint8_t isComplete;
 
     m_rx.is_Extended = isExtId(msg_received.ui32MsgID);
 
@@ -570,24 +1230,47 @@ void DecodeReceivedMessage(void)
     {
 
       case 0: /* Data Message */
-        if (m_rx.id == 0x200/*t.id_msg*/) /* TBD - Search for Message ID*/
+        sender = FindRxSender(m_rx.id);
+        if ((sender != 0) && (m_rx.id == sender->id_msg))
         {
 //          if (debug_state == ENABLE) write("Sender: Data Message Received!!");
           m_rx.dlc = msg_received.ui32MsgLen;
-          m_rx.data = msg_received.pui8MsgData;
+          wasMasked = EnterCritical();
+          entry = GetPending(m_rx.id, m_rx.cid, 0);
+          entry->data = ReadCanData(msg_received);
 //          if (debug_state == ENABLE) write("Sender: Calculate MAC Data");
-          m_rx.mac_computed = CalculateMacData();
+          entry->mac_computed = CalculateMacReceived(entry->cid, entry->data);
+          entry->has_data = 1;
+          isComplete = CompletePending(entry);
+          ExitCritical(wasMasked);
+          if (isComplete != 0)
+          {
+            LeiA_HandleDataMacReceived();
+          }
         }
       break;
 
       case 1: /* MAC Message */
-        if (m_rx.id == 0x201/*t.id_mac*/) /* TBD - Search for MAC ID*/
+        sender = FindRxSender(m_rx.id);
+        if ((sender != 0) && ((m_rx.id == sender->id_mac) || (m_rx.id == sender->id_mac_low)))
         {
 //          if (debug_state == ENABLE) write("Sender: MAC for Data Message Received!!");
           m_rx.dlc = msg_received.ui32MsgLen;
-          m_rx.mac_received = msg_received.pui8MsgData;
+          wasMasked = EnterCritical();
+          entry = GetPending(sender->id_msg, m_rx.cid, 1); /* paired with the data msg ID */
+          isComplete = 0;
+          if (entry != 0)
+          {
+            entry->mac_received = ReadCanData(msg_received);
+            entry->has_mac = 1;
+            isComplete = CompletePending(entry);
+          }
+          ExitCritical(wasMasked);
 //          if (debug_state == ENABLE) write("Sender: Handle Data & MAC");
-          LeiA_HandleDataMacReceived();
+          if (isComplete != 0)
+          {
+            LeiA_HandleDataMacReceived();
+          }
         }
       break;
 
@@ -596,7 +1279,7 @@ void DecodeReceivedMessage(void)
         {
 //          if (debug_state == ENABLE) write("Sender: eidi Message Received");
           m_rx.dlc = msg_received.ui32MsgLen;
-          m_rx.eid_received = msg_received.pui8MsgData;
+          m_rx.eid_received = ReadCanData(msg_received);
 //          if (debug_state == ENABLE) write("Sender: Calculate Eidi MAC");
           m_rx.eid_mac_computed = CalculateEidMac();
         }
@@ -607,7 +1290,7 @@ void DecodeReceivedMessage(void)
         {
 //          if (debug_state == ENABLE) write("Sender: MAC for eidi Message Received");
           m_rx.dlc = msg_received.ui32MsgLen;
-          m_rx.eid_mac_received = msg_received.pui8MsgData;
+          m_rx.eid_mac_received = ReadCanData(msg_received);
 //          if (debug_state == ENABLE) write("Sender: Handle MAC for eidi");
           LeiA_HandleEidiMacReceived();
         }
@@ -623,5 +1306,6 @@ void DecodeReceivedMessage(void)
 
 void msgRecieveHandler(tCANMsgObject msg){
     msg_received = msg;
+    ObserveFrame(msg, 0);
     DecodeReceivedMessage();
 }
@@ -8,6 +8,33 @@
 #ifndef LEIA_H_
 #define LEIA_H_
 
+/*************************************
+ * Configuration Section
+ *************************************/
+#define LEIA_TICK_MS               1u      /* period of LeiA_MainFunction calls in ms      */
+#define LEIA_BUS_BITRATE           500000u /* CAN bit rate in bit/s                        */
+#define LEIA_BUSLOAD_WINDOW_TICKS  100u    /* ticks per bus load measurement window       */
+#define LEIA_BUSLOAD_HIGH_PCT      50u     /* bus load (%) above which MACs are scheduled */
+#define LEIA_BUS_IDLE_TICKS        1u      /* ticks without traffic to consider bus idle (coarse) */
+#define LEIA_PENDING_SIZE          4u      /* data/MAC pairs waiting for their partner    */
+#define LEIA_RX_SENDERS            2u      /* authenticated senders this node receives from */
+#define LEIA_REPLAY_WINDOW         32u     /* older counters accepted out of order (<= 32) */
+
+/*************************************
+ * enum Section
+ *************************************/
+typedef enum{
+    LEIA_MAC_TX_IMMEDIATE = 0, /* send MAC right after the data frame on id_mac      */
+    LEIA_MAC_TX_DEFER_IDLE,    /* on a busy bus wait for an idle window (bounded)    */
+    LEIA_MAC_TX_REMAP_ID       /* on a busy bus send MAC on the low priority id      */
+}mac_tx_policy_t;
+
+typedef enum{
+    LEIA_MAC_SENT_IDLE = 0,    /* deferred MAC sent in a bus idle window             */
+    LEIA_MAC_SENT_LATENCY,     /* deferred MAC sent when the latency bound hit       */
+    LEIA_MAC_SENT_FLUSH        /* deferred MAC sent ahead of the next data frame     */
+}mac_tx_reason_t;
+
 /*************************************
  * struct Section
  *************************************/
@@ -15,6 +42,10 @@ typedef struct{
     uint16_t     id_msg;    /* 11-bit ID               */
     uint16_t     id_mac;    /* 11-bit ID for MAC       */
     uint16_t     id_fail;   /* 11-bit ID for AUTH Fail */
+    uint16_t     id_mac_low;      /* 11-bit low priority ID for MAC  */
+    uint8_t      mac_tx_policy;   /* mac_tx_policy_t                 */
+    uint16_t     mac_max_latency; /* max MAC deferral in ticks       */
+    uint16_t     rx_pair_timeout; /* max wait for data/MAC partner in ticks, > mac_max_latency */
     uint64_t   kid;       /* 128-bit Key             */
     uint64_t   eid;       /* 56-bit Epoch Counter    */
     uint64_t   keid;      /* 128-bit Temp Key        */
@@ -37,6 +68,40 @@ typedef struct{
     uint64_t   eid_mac_computed;
 } message_t;
 
+typedef struct{
+    uint8_t    is_used;
+    uint8_t    has_data;
+    uint8_t    has_mac;
+    uint16_t   id;             /* 11-bit ID of the data msg */
+    uint16_t   cid;
+    uint64_t   data;
+    uint64_t   mac_received;
+    uint64_t   mac_computed;
+    uint32_t   tick;           /* tick the first frame of the pair arrived at */
+} pending_t;
+
+typedef struct{
+    uint8_t    is_used;
+    uint16_t   id_msg;         /* 11-bit ID of the data msg                  */
+    uint16_t   id_mac;         /* 11-bit ID of the MAC msg                   */
+    uint16_t   id_mac_low;     /* 11-bit low priority ID of the MAC msg      */
+    uint16_t   cid;            /* newest accepted counter                    */
+    uint32_t   cid_mask;       /* accepted counters below cid, bit 0 = cid-1 */
+} rx_sender_t;
+
+typedef struct{
+    uint8_t    bus_load;             /* bus load (%) of the last window              */
+    uint32_t   mac_immediate;        /* MACs sent right after their data frame       */
+    uint32_t   mac_deferred;         /* MACs sent in a bus idle window               */
+    uint32_t   mac_forced;           /* deferred MACs sent when latency bound hit    */
+    uint32_t   mac_flushed;          /* deferred MACs sent ahead of next data frame  */
+    uint32_t   mac_remapped;         /* MACs sent on id_mac_low                      */
+    uint32_t   defer_latency_total;  /* sum of MAC deferral latency in ticks         */
+    uint32_t   defer_latency_max;    /* max MAC deferral latency in ticks            */
+    uint32_t   frames_delayed;       /* lower priority frames after own MAC, upper bound */
+    uint32_t   frames_delay_bits;    /* upper bound of queueing delay added, in bit times */
+} mac_tx_stats_t;
+
 /*************************************
  *      Functions Defination Section
  *************************************/
@@ -47,6 +112,7 @@ void DecodeReceivedMessage(void);
 uint64_t CalculateMacKeid(void);
 uint64_t CalculateEidMac(void);
 uint64_t  CalculateMacData(void);
+uint64_t CalculateMacReceived(uint16_t cid, uint64_t data);
 uint8_t ValidateEC(void);
 void UpdateEC(void);
 void UpdateCounters(void);
@@ -59,6 +125,26 @@ void LeiA_HandleEidiMacReceived(void);
 void LeiA_HandleDataMacReceived(void);
 void LeiA_SendAuthFailMessage(void);
 void DecodeReceivedMessage(void);
+uint8_t EnterCritical(void);
+void ExitCritical(uint8_t wasMasked);
+uint16_t BaseId(uint32_t id);
+uint32_t FrameBits(tCANMsgObject msg);
+void ObserveFrame(tCANMsgObject msg, uint8_t isOwn);
+uint8_t SendMac(tCANMsgObject msg);
+void SendPendingMac(mac_tx_reason_t reason);
+void ScheduleMac(uint32_t temp_id, uint64_t mac);
+void LeiA_SetMacTxPolicy(mac_tx_policy_t policy, uint16_t id_mac_low, uint16_t max_latency);
+void LeiA_GetMacTxStats(mac_tx_stats_t *stats);
+void LeiA_MainFunction(void);
+void LeiA_SetPairTimeout(uint16_t timeout);
+void LeiA_SetRxSender(uint8_t index, uint16_t id_msg, uint16_t id_mac, uint16_t id_mac_low);
+rx_sender_t *FindRxSender(uint16_t id);
+uint8_t ValidateCid(rx_sender_t *sender, uint16_t cid);
+void AcceptCid(rx_sender_t *sender, uint16_t cid);
+uint64_t ReadCanData(tCANMsgObject msg);
+pending_t *GetPending(uint16_t id, uint16_t cid, uint8_t isMac);
+void ExpirePending(void);
+uint8_t CompletePending(pending_t *entry);
 
 
 